@@ -13,7 +13,12 @@ void _Index::add_next(const std::string &line, const std::string &key) {
     getline(iss, actual_key, ',');
   }
   size_t length = line.length();
-  _idx_map[actual_key] = {_cursor, length};
+  // A tombstone is a record with an empty value: "key,\n".
+  if (length == actual_key.length() + 2) {
+    _idx_map.erase(actual_key);
+  } else {
+    _idx_map[actual_key] = {_cursor, length};
+  }
   _cursor += length;
 }
 
@@ -25,6 +30,10 @@ std::pair<long, size_t> _Index::get(const std::string &key) const {
   throw std::runtime_error("Key not found");
 }
 
+bool _Index::contains(const std::string &key) const {
+  return _idx_map.find(key) != _idx_map.end();
+}
+
 SimpleDbInMemoryIndex::SimpleDbInMemoryIndex(const std::string &filename)
     : filename(filename), _index() {
   std::ifstream file(filename);
@@ -62,4 +71,15 @@ nlohmann::json SimpleDbInMemoryIndex::get(const std::string &key) {
   file.read(&line[0], offset_length.second);
   file.close();
   return nlohmann::json::parse(line.substr(line.find(',') + 1));
+}
+
+void SimpleDbInMemoryIndex::remove(const std::string &key) {
+  if (!_index.contains(key)) {
+    return;
+  }
+  std::string line = key + ",\n";
+  std::ofstream file(filename, std::ios::app);
+  file << line;
+  file.close();
+  _index.add_next(line, key);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ public:
   _Index();
   void add_next(const std::string &line, const std::string &key = "");
   std::pair<long, size_t> get(const std::string &key) const;
+  bool contains(const std::string &key) const;
 
   const std::unordered_map<std::string, std::pair<long, size_t>> &
   get_idx_map() const {
@@ -25,6 +26,7 @@ public:
   SimpleDbInMemoryIndex(const std::string &filename = "database");
   void set(const std::string &key, const nlohmann::json &json_dict);
   nlohmann::json get(const std::string &key);
+  void remove(const std::string &key);
 
   const _Index &get_index() const { return _index; }
   const std::string &get_filename() const { return filename; }
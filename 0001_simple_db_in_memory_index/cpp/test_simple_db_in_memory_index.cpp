@@ -61,6 +61,22 @@ TEST_F(SimpleDbInMemoryIndexTest, GetInvalidKey) {
   EXPECT_EQ(db->get("invalid key"), nullptr);
 }
 
+// Test case for removing values
+TEST_F(SimpleDbInMemoryIndexTest, Remove) {
+  db->remove("greeting");
+  db->remove("invalid key");
+  EXPECT_EQ(db->get("greeting"), nullptr);
+  EXPECT_EQ(db->get("menu"), menu_json);
+  EXPECT_FALSE(db->get_index().contains("greeting"));
+
+  SimpleDbInMemoryIndex db2(filename);
+  EXPECT_EQ(db2.get("greeting"), nullptr);
+  EXPECT_EQ(db2.get_index().get_idx_map().size(), 1);
+
+  db->set("greeting", greeting_json);
+  EXPECT_EQ(db->get("greeting"), greeting_json);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -1,15 +1,79 @@
 #include "simple_db_multi_segments.h"
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <set>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+
+static const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+static size_t align_down(size_t value) {
+  return value / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+}
+
+static size_t align_up(size_t value) {
+  return align_down(value + DIRECT_IO_ALIGNMENT - 1);
+}
+
+// Numbers that compare equal must index under the same key, so whole floats
+// such as 199.0 or -0.0 are stored as the integers they are equal to.
+static nlohmann::json normalize_numbers(const nlohmann::json &value) {
+  if (value.is_number_float()) {
+    double number = value.get<double>();
+    if (number == std::trunc(number)) {
+      if (number < 0 &&
+          number >= double(std::numeric_limits<int64_t>::min())) {
+        return static_cast<int64_t>(number);
+      }
+      if (number >= 0 && number < std::ldexp(1.0, 64)) {
+        return static_cast<uint64_t>(number);
+      }
+    }
+    return value;
+  }
+  if (value.is_structured()) {
+    nlohmann::json normalized = value;
+    for (auto &element : normalized) {
+      element = normalize_numbers(element);
+    }
+    return normalized;
+  }
+  return value;
+}
+
+static double space_amplification(const std::vector<SegmentStats> &stats) {
+  size_t total_bytes = 0;
+  size_t live_bytes = 0;
+  for (const auto &segment : stats) {
+    total_bytes += segment.total_bytes;
+    live_bytes += segment.live_bytes;
+  }
+  if (live_bytes == 0) {
+    return total_bytes ? std::numeric_limits<double>::infinity() : 1.0;
+  }
+  return double(total_bytes) / live_bytes;
+}
 
 const char *IsADirectoryError::what() const noexcept {
   return "Not a directory, or the directory isn't formatted correctly";
 }
 
+const char *NoSuchIndexError::what() const noexcept {
+  return "No secondary index on the given path";
+}
+
 Index::Index(const std::string &segment_name)
     : segment_name(segment_name), cursor(0) {}
 
@@ -22,6 +86,13 @@ void Index::add_next(const std::string &line, const std::string &key) {
   size_t length = line.length();
   idx_map[actual_key] = {cursor, length};
   cursor += length;
+
+  // A tombstone is a record with an empty value: "key,\n".
+  if (length == actual_key.length() + 2) {
+    tombstones.insert(actual_key);
+  } else {
+    tombstones.erase(actual_key);
+  }
 }
 
 std::pair<size_t, size_t> Index::get(const std::string &key) const {
@@ -32,40 +103,386 @@ std::pair<size_t, size_t> Index::get(const std::string &key) const {
   throw std::runtime_error("Key not found");
 }
 
+bool Index::is_tombstone(const std::string &key) const {
+  return tombstones.count(key) > 0;
+}
+
 const std::string &Index::get_segment_name() const { return segment_name; }
 
-SimpleDbMultiSegments::SimpleDbMultiSegments(const std::string &dbname,
-                                             size_t segment_bytes_threshold)
+SecondaryIndex::SecondaryIndex(const std::string &path)
+    : path(path), pointer(path) {}
+
+void SecondaryIndex::add(const std::string &key,
+                         const nlohmann::json &document) {
+  remove(key);
+  if (!document.is_structured() || !document.contains(pointer)) {
+    return;
+  }
+  std::string value = normalize_numbers(document.at(pointer)).dump();
+  value_map[value].insert(key);
+  key_map[key] = value;
+}
+
+void SecondaryIndex::remove(const std::string &key) {
+  auto it = key_map.find(key);
+  if (it == key_map.end()) {
+    return;
+  }
+  auto keys = value_map.find(it->second);
+  keys->second.erase(key);
+  if (keys->second.empty()) {
+    value_map.erase(keys);
+  }
+  key_map.erase(it);
+}
+
+void SecondaryIndex::clear() {
+  value_map.clear();
+  key_map.clear();
+}
+
+std::vector<std::string>
+SecondaryIndex::find(const nlohmann::json &value) const {
+  auto it = value_map.find(normalize_numbers(value).dump());
+  if (it == value_map.end()) {
+    return {};
+  }
+  return std::vector<std::string>(it->second.begin(), it->second.end());
+}
+
+SegmentWriter::SegmentWriter(const std::string &segment_name, size_t offset,
+                             const SegmentFileOptions &options,
+                             size_t preallocate_bytes)
+    : segment_name(segment_name), fd(-1), offset(offset), direct(false),
+      preallocated(false), truncate_on_seal(false), buffer(nullptr),
+      buffer_capacity(0), buffer_offset(0), buffer_length(0) {
+#ifdef O_DIRECT
+  if (options.direct_io) {
+    fd = ::open(segment_name.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
+    direct = fd >= 0;
+  }
+#endif
+  if (fd < 0) {
+    fd = ::open(segment_name.c_str(), O_WRONLY | O_CREAT, 0644);
+  }
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), segment_name);
+  }
+
+  try {
+    // Preallocation only saves work, so a file system without fallocate is
+    // not an error.
+    if (options.preallocate && preallocate_bytes > offset &&
+        ::fallocate(fd, 0, 0, preallocate_bytes) == 0) {
+      preallocated = true;
+      truncate_on_seal = true;
+    }
+
+    if (direct) {
+      // O_DIRECT writes whole blocks, so a partial block already at the end
+      // of the file is read back into the buffer and completed there.
+      truncate_on_seal = true;
+      reserve_buffer(DIRECT_IO_ALIGNMENT);
+      buffer_offset = align_down(offset);
+      buffer_length = offset - buffer_offset;
+      if (buffer_length > 0) {
+        ssize_t n = ::pread(fd, buffer, DIRECT_IO_ALIGNMENT, buffer_offset);
+        if (n < 0) {
+          throw std::system_error(errno, std::generic_category(),
+                                  segment_name);
+        }
+        if (static_cast<size_t>(n) < buffer_length) {
+          throw std::runtime_error("Short read of segment " + segment_name);
+        }
+      }
+    }
+  } catch (...) {
+    ::close(fd);
+    std::free(buffer);
+    throw;
+  }
+}
+
+SegmentWriter::~SegmentWriter() {
+  try {
+    seal();
+  } catch (const std::exception &) {
+  }
+  std::free(buffer);
+}
+
+void SegmentWriter::write(const std::string &data) {
+  if (fd < 0) {
+    throw std::runtime_error("Segment writer is sealed");
+  }
+
+  if (!direct) {
+    for (size_t written = 0; written < data.size();) {
+      ssize_t result = ::pwrite(fd, data.data() + written,
+                                data.size() - written, offset + written);
+      if (result < 0) {
+        throw std::system_error(errno, std::generic_category(), segment_name);
+      }
+      written += result;
+    }
+    offset += data.size();
+    return;
+  }
+
+  reserve_buffer(align_up(buffer_length + data.size()));
+  std::memcpy(buffer + buffer_length, data.data(), data.size());
+  buffer_length += data.size();
+  offset += data.size();
+
+  size_t full_blocks = align_down(buffer_length);
+  if (full_blocks > 0) {
+    write_buffer(full_blocks);
+    std::memmove(buffer, buffer + full_blocks, buffer_length - full_blocks);
+    buffer_offset += full_blocks;
+    buffer_length -= full_blocks;
+  }
+}
+
+void SegmentWriter::flush() {
+  if (fd < 0 || !direct || buffer_length == 0) {
+    return;
+  }
+  // The partial block goes out padded with zeros and stays in the buffer,
+  // to be rewritten once it fills up.
+  size_t padded_length = align_up(buffer_length);
+  std::memset(buffer + buffer_length, 0, padded_length - buffer_length);
+  write_buffer(padded_length);
+}
+
+void SegmentWriter::sync() {
+  if (fd >= 0 && ::fdatasync(fd) < 0) {
+    throw std::system_error(errno, std::generic_category(), segment_name);
+  }
+}
+
+void SegmentWriter::seal() {
+  if (fd < 0) {
+    return;
+  }
+  try {
+    flush();
+  } catch (const std::exception &) {
+    ::close(fd);
+    fd = -1;
+    throw;
+  }
+  int result = truncate_on_seal ? ::ftruncate(fd, offset) : 0;
+  int error = errno;
+  ::close(fd);
+  fd = -1;
+  if (result < 0) {
+    throw std::system_error(error, std::generic_category(), segment_name);
+  }
+}
+
+void SegmentWriter::read_unflushed(size_t offset, std::string &data) const {
+  if (fd < 0 || buffer_length == 0) {
+    return;
+  }
+  size_t begin = std::max(offset, buffer_offset);
+  size_t end = std::min(offset + data.size(), buffer_offset + buffer_length);
+  if (begin < end) {
+    std::memcpy(&data[begin - offset], buffer + (begin - buffer_offset),
+                end - begin);
+  }
+}
+
+void SegmentWriter::write_buffer(size_t length) {
+  for (size_t written = 0; written < length;) {
+    ssize_t result = ::pwrite(fd, buffer + written, length - written,
+                              buffer_offset + written);
+    if (result < 0) {
+      throw std::system_error(errno, std::generic_category(), segment_name);
+    }
+    written += result;
+  }
+}
+
+void SegmentWriter::reserve_buffer(size_t capacity) {
+  if (capacity <= buffer_capacity) {
+    return;
+  }
+  void *new_buffer = nullptr;
+  if (posix_memalign(&new_buffer, DIRECT_IO_ALIGNMENT, capacity) != 0) {
+    throw std::bad_alloc();
+  }
+  if (buffer) {
+    std::memcpy(new_buffer, buffer, buffer_length);
+    std::free(buffer);
+  }
+  // Whatever ends up in the block is written to disk, so never leave stale
+  // heap contents in it.
+  std::memset(static_cast<char *>(new_buffer) + buffer_length, 0,
+              capacity - buffer_length);
+  buffer = static_cast<char *>(new_buffer);
+  buffer_capacity = capacity;
+}
+
+RateLimiter::RateLimiter(size_t bytes_per_second, size_t burst_bytes)
+    : bytes_per_second(bytes_per_second),
+      burst_bytes(burst_bytes ? burst_bytes : bytes_per_second),
+      tokens(this->burst_bytes), last_refill(std::chrono::steady_clock::now()) {
+}
+
+void RateLimiter::acquire(size_t bytes) {
+  if (bytes_per_second == 0) {
+    return;
+  }
+  refill();
+
+  // Requests larger than the bucket are allowed to go into debt, which the
+  // following calls pay back.
+  tokens -= bytes;
+  if (tokens < 0) {
+    std::this_thread::sleep_for(
+        std::chrono::duration<double>(-tokens / bytes_per_second));
+  }
+}
+
+bool RateLimiter::try_acquire(size_t bytes) {
+  if (bytes_per_second == 0) {
+    return true;
+  }
+  refill();
+  // A request larger than the bucket is granted once the bucket is full.
+  if (tokens < std::min(double(bytes), burst_bytes)) {
+    return false;
+  }
+  tokens -= bytes;
+  return true;
+}
+
+void RateLimiter::refill() {
+  auto now = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(now - last_refill).count();
+  tokens = std::min(burst_bytes, tokens + elapsed * bytes_per_second);
+  last_refill = now;
+}
+
+SizeTieredCompactionStrategy::SizeTieredCompactionStrategy(
+    size_t min_threshold, size_t max_threshold, double bucket_low,
+    double bucket_high)
+    : min_threshold(std::max(min_threshold, size_t(2))),
+      max_threshold(std::max(max_threshold, this->min_threshold)),
+      bucket_low(bucket_low), bucket_high(bucket_high) {}
+
+std::vector<size_t> SizeTieredCompactionStrategy::pick_segments(
+    const std::vector<SegmentStats> &segments) const {
+  std::vector<SegmentStats> sorted;
+  for (const auto &segment : segments) {
+    if (segment.total_bytes > 0) {
+      sorted.push_back(segment);
+    }
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const SegmentStats &a, const SegmentStats &b) {
+              return a.total_bytes < b.total_bytes;
+            });
+
+  std::vector<std::vector<SegmentStats>> buckets;
+  double average = 0;
+  for (const auto &segment : sorted) {
+    if (!buckets.empty() && segment.total_bytes >= average * bucket_low &&
+        segment.total_bytes <= average * bucket_high) {
+      auto &bucket = buckets.back();
+      average = (average * bucket.size() + segment.total_bytes) /
+                (bucket.size() + 1);
+      bucket.push_back(segment);
+    } else {
+      buckets.push_back({segment});
+      average = segment.total_bytes;
+    }
+  }
+
+  // Buckets are ordered by size, so the first eligible one is the cheapest to
+  // merge.
+  for (const auto &bucket : buckets) {
+    if (bucket.size() >= min_threshold) {
+      std::vector<size_t> positions;
+      for (size_t i = 0; i < bucket.size() && i < max_threshold; ++i) {
+        positions.push_back(bucket[i].position);
+      }
+      std::sort(positions.begin(), positions.end());
+      return positions;
+    }
+  }
+  return {};
+}
+
+DeadBytesRatioCompactionStrategy::DeadBytesRatioCompactionStrategy(
+    double min_dead_ratio, size_t max_segments)
+    : min_dead_ratio(min_dead_ratio),
+      max_segments(std::max(max_segments, size_t(1))) {}
+
+std::vector<size_t> DeadBytesRatioCompactionStrategy::pick_segments(
+    const std::vector<SegmentStats> &segments) const {
+  std::vector<SegmentStats> candidates;
+  for (const auto &segment : segments) {
+    if (segment.dead_bytes() > 0 && segment.dead_ratio() >= min_dead_ratio) {
+      candidates.push_back(segment);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const SegmentStats &a, const SegmentStats &b) {
+              if (a.dead_ratio() != b.dead_ratio()) {
+                return a.dead_ratio() > b.dead_ratio();
+              }
+              return a.dead_bytes() > b.dead_bytes();
+            });
+
+  std::vector<size_t> positions;
+  for (size_t i = 0; i < candidates.size() && i < max_segments; ++i) {
+    positions.push_back(candidates[i].position);
+  }
+  std::sort(positions.begin(), positions.end());
+  return positions;
+}
+
+SimpleDbMultiSegments::SimpleDbMultiSegments(
+    const std::string &dbname, size_t segment_bytes_threshold,
+    const CompactionOptions &compaction_options,
+    const SegmentFileOptions &segment_file_options)
     : dbname(dbname), indexes_loaded(false),
-      segment_bytes_threshold(std::max(segment_bytes_threshold, size_t(1))) {
+      segment_bytes_threshold(std::max(segment_bytes_threshold, size_t(1))),
+      compaction_options(compaction_options),
+      rate_limiter(compaction_options.bytes_per_second),
+      segment_file_options(segment_file_options), last_segment_timestamp(0) {
   check_db_directory();
   load_indexes();
 }
 
+SimpleDbMultiSegments::~SimpleDbMultiSegments() {
+  // An unfinished compaction is dropped; its inputs are still in place.
+  if (compaction_job) {
+    abandon_compaction();
+  }
+}
+
 void SimpleDbMultiSegments::set(const std::string &key,
                                 const nlohmann::json &json_dict) {
-  if (indexes.empty() ||
-      indexes.back()->get_cursor() >= segment_bytes_threshold) {
-    auto index = std::make_shared<Index>(
-        dbname + "/segment_" +
-        std::to_string(get_epoch_time_in_microseconds()) + ".db");
-    indexes.push_back(index);
+  append(key, key + "," + json_dict.dump() + "\n");
+  for (auto &[_, secondary_index] : secondary_indexes) {
+    secondary_index->add(key, json_dict);
   }
-  auto index = indexes.back();
-  std::string line = key + "," + json_dict.dump() + "\n";
-  index->add_next(line, key);
-  std::ofstream file(index->get_segment_name(), std::ios::app);
-  file << line;
 }
 
 nlohmann::json SimpleDbMultiSegments::get(const std::string &key) {
   for (auto it = indexes.rbegin(); it != indexes.rend(); ++it) {
+    if ((*it)->is_tombstone(key)) {
+      return nullptr;
+    }
     try {
       auto [offset, length] = (*it)->get(key);
       std::ifstream file((*it)->get_segment_name());
       file.seekg(offset);
       std::string line(length, '\0');
       file.read(&line[0], length);
+      read_unflushed(**it, offset, line);
       return nlohmann::json::parse(line.substr(line.find(',') + 1));
     } catch (const std::exception &) {
       continue;
@@ -74,43 +491,358 @@ nlohmann::json SimpleDbMultiSegments::get(const std::string &key) {
   return nullptr;
 }
 
+void SimpleDbMultiSegments::remove(const std::string &key) {
+  for (auto it = indexes.rbegin(); it != indexes.rend(); ++it) {
+    const auto &idx_map = (*it)->get_idx_map();
+    if (idx_map.find(key) == idx_map.end()) {
+      continue;
+    }
+    if (!(*it)->is_tombstone(key)) {
+      append(key, key + ",\n");
+      for (auto &[_, secondary_index] : secondary_indexes) {
+        secondary_index->remove(key);
+      }
+    }
+    return;
+  }
+}
+
+// Writes out whatever the active segment still buffers and waits for it to
+// reach the disk.
+void SimpleDbMultiSegments::flush() {
+  if (writer) {
+    writer->flush();
+    writer->sync();
+  }
+}
+
 void SimpleDbMultiSegments::compact(size_t new_segment_bytes_threshold) {
-  size_t current_segment_bytes_threshold = new_segment_bytes_threshold
-                                               ? new_segment_bytes_threshold
-                                               : segment_bytes_threshold;
+  finish_compaction();
+  std::vector<size_t> positions;
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    positions.push_back(i);
+  }
+  start_compaction(positions, new_segment_bytes_threshold);
+  finish_compaction();
+}
+
+bool SimpleDbMultiSegments::maybe_compact() {
+  finish_compaction();
+  std::vector<size_t> positions;
+  size_t new_segment_bytes_threshold;
+  if (!pick_compaction(positions, new_segment_bytes_threshold)) {
+    return false;
+  }
+  start_compaction(positions, new_segment_bytes_threshold);
+  finish_compaction();
+  return true;
+}
+
+void SimpleDbMultiSegments::finish_compaction() {
+  if (compaction_job) {
+    step_compaction(true);
+  }
+}
+
+bool SimpleDbMultiSegments::pick_compaction(
+    std::vector<size_t> &positions, size_t &new_segment_bytes_threshold) const {
+  if (!compaction_options.strategy || indexes.size() < 2) {
+    return false;
+  }
+
+  bool too_many_segments =
+      compaction_options.max_segment_count > 0 &&
+      indexes.size() > compaction_options.max_segment_count;
+  if (!too_many_segments && compaction_options.max_space_amplification <= 0) {
+    return false;
+  }
+
+  auto stats = get_segment_stats();
+  bool too_much_garbage =
+      compaction_options.max_space_amplification > 0 &&
+      space_amplification(stats) > compaction_options.max_space_amplification;
+  if (!too_many_segments && !too_much_garbage) {
+    return false;
+  }
+
+  positions = compaction_options.strategy->pick_segments(stats);
+  if (positions.empty()) {
+    return false;
+  }
+
+  // The output goes into a single segment sized by its inputs, so merging
+  // a tier yields one larger segment rather than as many small ones.
+  size_t input_bytes = 0;
+  for (size_t position : positions) {
+    input_bytes += stats[position].total_bytes;
+  }
+  new_segment_bytes_threshold = std::max(input_bytes, size_t(1));
+  return true;
+}
+
+void SimpleDbMultiSegments::append(const std::string &key,
+                                   const std::string &line) {
+  if (!indexes.empty() &&
+      indexes.back()->get_cursor() >= segment_bytes_threshold) {
+    // Every segment is sealed at this point, so compaction may pick any of
+    // them and the new segment is created after its output.
+    writer.reset();
+    std::vector<size_t> positions;
+    size_t new_segment_bytes_threshold;
+    if (!compaction_job &&
+        pick_compaction(positions, new_segment_bytes_threshold)) {
+      start_compaction(positions, new_segment_bytes_threshold);
+    }
+  }
+  if (indexes.empty() ||
+      indexes.back()->get_cursor() >= segment_bytes_threshold) {
+    writer.reset();
+    indexes.push_back(std::make_shared<Index>(new_segment_name()));
+    write_manifest();
+  }
+  auto index = indexes.back();
+  if (!writer || writer->get_segment_name() != index->get_segment_name()) {
+    writer = open_writer(*index, segment_bytes_threshold);
+  }
+  writer->write(line);
+  index->add_next(line, key);
+
+  if (compaction_job) {
+    step_compaction(false);
+  }
+}
+
+std::unique_ptr<SegmentWriter>
+SimpleDbMultiSegments::open_writer(const Index &index,
+                                   size_t bytes_threshold) const {
+  return std::make_unique<SegmentWriter>(index.get_segment_name(),
+                                         index.get_cursor(),
+                                         segment_file_options, bytes_threshold);
+}
+
+void SimpleDbMultiSegments::read_unflushed(const Index &index, size_t offset,
+                                           std::string &line) const {
+  if (writer && writer->get_segment_name() == index.get_segment_name()) {
+    writer->read_unflushed(offset, line);
+  }
+}
+
+std::vector<SegmentStats> SimpleDbMultiSegments::get_segment_stats() const {
+  std::vector<SegmentStats> stats(indexes.size());
+  std::unordered_set<std::string> newer_keys;
+  for (size_t i = indexes.size(); i-- > 0;) {
+    const auto &index = indexes[i];
+    size_t live_bytes = 0;
+    for (const auto &[key, offset_length] : index->get_idx_map()) {
+      if (newer_keys.insert(key).second && !index->is_tombstone(key)) {
+        live_bytes += offset_length.second;
+      }
+    }
+    stats[i] = {i, index->get_cursor(), live_bytes};
+  }
+  return stats;
+}
+
+double SimpleDbMultiSegments::get_space_amplification() const {
+  return space_amplification(get_segment_stats());
+}
 
-  std::set<std::string> checked_keys;
-  std::vector<std::shared_ptr<Index>> new_indexes;
-  auto new_index = std::make_shared<Index>(
-      dbname + "/segment_" + std::to_string(get_epoch_time_in_microseconds()) +
-      ".db");
+void SimpleDbMultiSegments::create_index(const std::string &path) {
+  if (secondary_indexes.count(path)) {
+    return;
+  }
+  auto secondary_index = std::make_shared<SecondaryIndex>(path);
 
+  std::unordered_set<std::string> newer_keys;
   for (auto it = indexes.rbegin(); it != indexes.rend(); ++it) {
-    for (const auto &[key, _] : (*it)->get_idx_map()) {
-      if (checked_keys.find(key) != checked_keys.end())
+    std::ifstream file((*it)->get_segment_name());
+    for (const auto &[key, offset_length] : (*it)->get_idx_map()) {
+      if (!newer_keys.insert(key).second || (*it)->is_tombstone(key)) {
         continue;
-      checked_keys.insert(key);
+      }
+      auto [offset, length] = offset_length;
+      file.clear();
+      file.seekg(offset);
+      std::string line(length, '\0');
+      file.read(&line[0], length);
+      read_unflushed(**it, offset, line);
+      secondary_index->add(
+          key, nlohmann::json::parse(line.substr(line.find(',') + 1)));
+    }
+  }
+
+  secondary_indexes[path] = secondary_index;
+}
+
+std::vector<std::string>
+SimpleDbMultiSegments::find(const std::string &path,
+                            const nlohmann::json &value) const {
+  auto it = secondary_indexes.find(path);
+  if (it == secondary_indexes.end()) {
+    throw NoSuchIndexError();
+  }
+  return it->second->find(value);
+}
+
+void SimpleDbMultiSegments::start_compaction(
+    const std::vector<size_t> &positions, size_t new_segment_bytes_threshold) {
+  if (positions.empty()) {
+    return;
+  }
+  std::set<size_t> selected(positions.begin(), positions.end());
 
-      if (new_index->get_cursor() >= current_segment_bytes_threshold) {
-        new_indexes.push_back(new_index);
-        new_index = std::make_shared<Index>(
-            dbname + "/segment_" +
-            std::to_string(get_epoch_time_in_microseconds()) + ".db");
+  auto job = std::make_unique<CompactionJob>();
+  job->segment_bytes_threshold = new_segment_bytes_threshold
+                                     ? new_segment_bytes_threshold
+                                     : segment_bytes_threshold;
+  // A full compaction reads every live record anyway, so the secondary
+  // indexes are rebuilt from what it copies.
+  job->rebuild_secondary_indexes = selected.size() == indexes.size();
+  if (job->rebuild_secondary_indexes) {
+    for (const auto &[path, _] : secondary_indexes) {
+      job->secondary_indexes[path] = std::make_shared<SecondaryIndex>(path);
+    }
+  }
+
+  // The active segment may be among the inputs, so its writer is sealed
+  // first; append() reopens whichever segment ends up last.
+  writer.reset();
+
+  // Only the newest version of each key is copied. Keys overwritten by a
+  // newer segment are dropped, whether that segment is selected or not.
+  // Segments are sealed, so the plan stays valid while later writes go to
+  // newer segments.
+  std::unordered_set<std::string> newer_keys;
+  for (size_t i = indexes.size(); i-- > 0;) {
+    const auto &index = indexes[i];
+    if (selected.count(i)) {
+      job->inputs.push_back(index);
+      for (const auto &[key, _] : index->get_idx_map()) {
+        if (newer_keys.count(key)) {
+          continue;
+        }
+
+        // A tombstone is only needed while a segment outliving this
+        // compaction still holds an older version of the key.
+        if (index->is_tombstone(key)) {
+          bool shadows_survivor = false;
+          for (size_t j = 0; j < i && !shadows_survivor; ++j) {
+            const auto &older_idx_map = indexes[j]->get_idx_map();
+            shadows_survivor = !selected.count(j) &&
+                               older_idx_map.find(key) != older_idx_map.end();
+          }
+          if (!shadows_survivor) {
+            continue;
+          }
+        }
+        job->records.emplace_back(index, key);
       }
+    }
+    for (const auto &[key, _] : index->get_idx_map()) {
+      newer_keys.insert(key);
+    }
+  }
+
+  compaction_job = std::move(job);
+}
+
+void SimpleDbMultiSegments::step_compaction(bool blocking) {
+  auto &job = *compaction_job;
+  try {
+    while (job.next_record < job.records.size()) {
+      const auto &[source, key] = job.records[job.next_record];
+      // Each record is read once and written once.
+      size_t bytes = 2 * source->get(key).second;
+      if (blocking) {
+        rate_limiter.acquire(bytes);
+      } else if (!rate_limiter.try_acquire(bytes)) {
+        return;
+      }
+      copy_record(source, key);
+      ++job.next_record;
+    }
+  } catch (const std::exception &) {
+    abandon_compaction();
+    throw;
+  }
+  complete_compaction();
+}
 
-      nlohmann::json value = get(key);
-      std::string line = key + "," + value.dump() + "\n";
-      new_index->add_next(line, key);
-      std::ofstream file(new_index->get_segment_name(), std::ios::app);
-      file << line;
+void SimpleDbMultiSegments::copy_record(const std::shared_ptr<Index> &source,
+                                        const std::string &key) {
+  auto &job = *compaction_job;
+  if (job.source != source) {
+    job.input = std::ifstream(source->get_segment_name());
+    job.source = source;
+  }
+
+  auto [offset, length] = source->get(key);
+  job.input.clear();
+  job.input.seekg(offset);
+  std::string line(length, '\0');
+  job.input.read(&line[0], length);
+  // The source segment is deleted afterwards, so a bad read must not be
+  // copied over it.
+  if (size_t(job.input.gcount()) != length || line.back() != '\n') {
+    throw std::runtime_error("Short read from " + source->get_segment_name());
+  }
+
+  if (!job.writer ||
+      job.outputs.back()->get_cursor() >= job.segment_bytes_threshold) {
+    if (job.writer) {
+      job.writer->seal();
     }
+    job.outputs.push_back(std::make_shared<Index>(new_segment_name()));
+    job.writer = open_writer(*job.outputs.back(), job.segment_bytes_threshold);
   }
+  job.writer->write(line);
+  job.outputs.back()->add_next(line, key);
+
+  if (!source->is_tombstone(key) && !job.secondary_indexes.empty()) {
+    auto document = nlohmann::json::parse(line.substr(line.find(',') + 1));
+    for (auto &[_, secondary_index] : job.secondary_indexes) {
+      secondary_index->add(key, document);
+    }
+  }
+}
 
-  if (!new_index->get_idx_map().empty()) {
-    new_indexes.push_back(new_index);
+void SimpleDbMultiSegments::complete_compaction() {
+  auto job = std::move(compaction_job);
+  if (job->writer) {
+    job->writer->seal();
   }
 
-  indexes = std::move(new_indexes);
+  // The merged segments take the place of the newest input, and the
+  // manifest records that order for the next time the database is opened.
+  // Inputs are listed newest first.
+  std::set<std::shared_ptr<Index>> inputs(job->inputs.begin(),
+                                          job->inputs.end());
+  std::vector<std::shared_ptr<Index>> result;
+  for (const auto &index : indexes) {
+    if (!inputs.count(index)) {
+      result.push_back(index);
+    } else if (index == job->inputs.front()) {
+      result.insert(result.end(), job->outputs.begin(), job->outputs.end());
+    }
+  }
+  indexes = std::move(result);
+  if (job->rebuild_secondary_indexes) {
+    secondary_indexes = std::move(job->secondary_indexes);
+  }
+  write_manifest();
+
+  job->input.close();
+  for (const auto &index : job->inputs) {
+    std::filesystem::remove(index->get_segment_name());
+  }
+}
+
+void SimpleDbMultiSegments::abandon_compaction() {
+  auto job = std::move(compaction_job);
+  job->writer.reset();
+  for (const auto &output : job->outputs) {
+    std::filesystem::remove(output->get_segment_name());
+  }
 }
 
 void SimpleDbMultiSegments::check_db_directory() {
@@ -135,6 +867,10 @@ void SimpleDbMultiSegments::load_index(Index &index) {
   std::ifstream file(index.get_segment_name());
   std::string line;
   while (std::getline(file, line)) {
+    // A segment that was not sealed may end in preallocated or padding zeros.
+    if (!line.empty() && line[0] == '\0') {
+      break;
+    }
     index.add_next(line + "\n");
   }
 }
@@ -142,17 +878,69 @@ void SimpleDbMultiSegments::load_index(Index &index) {
 void SimpleDbMultiSegments::load_indexes() {
   if (!indexes_loaded) {
     auto directory = std::filesystem::path(dbname);
+    std::vector<std::filesystem::path> segment_files;
     for (const auto &entry : std::filesystem::directory_iterator(directory)) {
       if (entry.path().filename().string().find("segment_") == 0) {
-        auto index = std::make_shared<Index>(entry.path().string());
-        indexes.push_back(index);
-        load_index(*index);
+        segment_files.push_back(entry.path());
+        last_segment_timestamp = std::max(
+            last_segment_timestamp,
+            int64_t(std::strtoll(
+                entry.path().stem().string().substr(8).c_str(), nullptr, 10)));
+      }
+    }
+
+    std::ifstream manifest(directory / ".simple_db_multi_segments_manifest");
+    if (manifest.is_open()) {
+      // Compaction places merged segments among older ones, so the manifest
+      // rather than the names holds the order. Files it does not list are
+      // leftovers of an interrupted compaction.
+      segment_files.clear();
+      std::string name;
+      while (std::getline(manifest, name)) {
+        if (std::filesystem::exists(directory / name)) {
+          segment_files.push_back(directory / name);
+        }
       }
+    } else {
+      // Databases written before the manifest existed never reordered
+      // segments, so their creation time gives the order.
+      std::sort(segment_files.begin(), segment_files.end());
+    }
+
+    for (const auto &path : segment_files) {
+      auto index = std::make_shared<Index>(path.string());
+      indexes.push_back(index);
+      load_index(*index);
     }
     indexes_loaded = true;
   }
 }
 
+void SimpleDbMultiSegments::write_manifest() const {
+  auto directory = std::filesystem::path(dbname);
+  auto manifest = directory / ".simple_db_multi_segments_manifest";
+  auto temporary = directory / ".simple_db_multi_segments_manifest.tmp";
+  {
+    std::ofstream file(temporary, std::ios::trunc);
+    for (const auto &index : indexes) {
+      file << std::filesystem::path(index->get_segment_name())
+                  .filename()
+                  .string()
+           << "\n";
+    }
+    if (!file.flush()) {
+      throw std::runtime_error("Cannot write " + temporary.string());
+    }
+  }
+  std::filesystem::rename(temporary, manifest);
+}
+
+std::string SimpleDbMultiSegments::new_segment_name() {
+  last_segment_timestamp =
+      std::max(get_epoch_time_in_microseconds(), last_segment_timestamp + 1);
+  return dbname + "/segment_" + std::to_string(last_segment_timestamp) + ".db";
+}
+
 int64_t SimpleDbMultiSegments::get_epoch_time_in_microseconds() const {
   auto now = std::chrono::system_clock::now();
   auto epoch = now.time_since_epoch();
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <chrono>
+#include <fstream>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include <set>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 class IsADirectoryError : public std::exception {
@@ -11,11 +15,17 @@ public:
   const char *what() const noexcept override;
 };
 
+class NoSuchIndexError : public std::exception {
+public:
+  const char *what() const noexcept override;
+};
+
 class Index {
 public:
   Index(const std::string &segment_name);
   void add_next(const std::string &line, const std::string &key = "");
   std::pair<size_t, size_t> get(const std::string &key) const;
+  bool is_tombstone(const std::string &key) const;
   const std::string &get_segment_name() const;
 
   size_t get_cursor() const { return cursor; }
@@ -27,29 +37,243 @@ public:
 private:
   std::string segment_name;
   std::unordered_map<std::string, std::pair<size_t, size_t>> idx_map;
+  std::unordered_set<std::string> tombstones;
   size_t cursor;
 };
 
+// Maps the value found at a JSON pointer path in each document to the keys
+// holding it. Documents without the path are not indexed.
+class SecondaryIndex {
+public:
+  SecondaryIndex(const std::string &path);
+  void add(const std::string &key, const nlohmann::json &document);
+  void remove(const std::string &key);
+  void clear();
+  // Values match by their JSON serialization, except that numbers match by
+  // value, so 199.0 finds 199.
+  std::vector<std::string> find(const nlohmann::json &value) const;
+
+  const std::string &get_path() const { return path; }
+
+private:
+  std::string path;
+  nlohmann::json::json_pointer pointer;
+  std::unordered_map<std::string, std::set<std::string>> value_map;
+  std::unordered_map<std::string, std::string> key_map;
+};
+
+struct SegmentFileOptions {
+  // Reserve segment_bytes_threshold bytes with fallocate when a segment is
+  // opened for writing.
+  bool preallocate = false;
+  // Write with O_DIRECT through block-aligned buffers, bypassing the page
+  // cache. Falls back to buffered writes if the file system refuses it.
+  // Records only reach the file a whole block at a time, so up to one block
+  // of acknowledged writes lives in memory until the segment is sealed or
+  // SimpleDbMultiSegments::flush() is called. A crash loses them, and other
+  // instances opened on the same directory do not see them.
+  bool direct_io = false;
+};
+
+// Appends records to one segment file. The file may be longer than the data
+// while it is being written; seal() truncates it to the real size.
+//
+// With O_DIRECT, records collect in an aligned buffer and only whole blocks
+// are written, so up to one block of the newest records exists only in
+// memory until flush() or seal(). read_unflushed() serves those bytes.
+class SegmentWriter {
+public:
+  SegmentWriter(const std::string &segment_name, size_t offset,
+                const SegmentFileOptions &options, size_t preallocate_bytes);
+  SegmentWriter(const SegmentWriter &) = delete;
+  SegmentWriter &operator=(const SegmentWriter &) = delete;
+  ~SegmentWriter();
+  void write(const std::string &data);
+  void flush();
+  void sync();
+  void seal();
+  void read_unflushed(size_t offset, std::string &data) const;
+
+  const std::string &get_segment_name() const { return segment_name; }
+  bool is_direct() const { return direct; }
+  bool is_preallocated() const { return preallocated; }
+
+private:
+  std::string segment_name;
+  int fd;
+  size_t offset;
+  bool direct;
+  bool preallocated;
+  bool truncate_on_seal;
+  char *buffer;
+  size_t buffer_capacity;
+  size_t buffer_offset;
+  size_t buffer_length;
+
+  void reserve_buffer(size_t capacity);
+  void write_buffer(size_t length);
+};
+
+// Token bucket limiting how many bytes per second compaction may read and
+// write. A rate of 0 means unlimited.
+class RateLimiter {
+public:
+  RateLimiter(size_t bytes_per_second = 0, size_t burst_bytes = 0);
+  void acquire(size_t bytes);
+  bool try_acquire(size_t bytes);
+
+  size_t get_bytes_per_second() const { return bytes_per_second; }
+
+private:
+  size_t bytes_per_second;
+  double burst_bytes;
+  double tokens;
+  std::chrono::steady_clock::time_point last_refill;
+
+  void refill();
+};
+
+// Tombstones count as dead bytes, as do the records they shadow.
+struct SegmentStats {
+  size_t position;
+  size_t total_bytes;
+  size_t live_bytes;
+
+  size_t dead_bytes() const { return total_bytes - live_bytes; }
+  double dead_ratio() const {
+    return total_bytes ? double(dead_bytes()) / total_bytes : 0.0;
+  }
+};
+
+class CompactionStrategy {
+public:
+  virtual ~CompactionStrategy() = default;
+  // Receives every segment, oldest first, and returns the positions of
+  // the segments to merge. An empty result means nothing is worth compacting.
+  virtual std::vector<size_t>
+  pick_segments(const std::vector<SegmentStats> &segments) const = 0;
+};
+
+// Merges at least min_threshold segments of similar size, so every byte is
+// rewritten roughly once per size tier.
+class SizeTieredCompactionStrategy : public CompactionStrategy {
+public:
+  SizeTieredCompactionStrategy(size_t min_threshold = 4,
+                               size_t max_threshold = 32,
+                               double bucket_low = 0.5,
+                               double bucket_high = 1.5);
+  std::vector<size_t>
+  pick_segments(const std::vector<SegmentStats> &segments) const override;
+
+private:
+  size_t min_threshold;
+  size_t max_threshold;
+  double bucket_low;
+  double bucket_high;
+};
+
+// Merges the segments holding the largest share of overwritten bytes.
+class DeadBytesRatioCompactionStrategy : public CompactionStrategy {
+public:
+  DeadBytesRatioCompactionStrategy(double min_dead_ratio = 0.5,
+                                   size_t max_segments = 4);
+  std::vector<size_t>
+  pick_segments(const std::vector<SegmentStats> &segments) const override;
+
+private:
+  double min_dead_ratio;
+  size_t max_segments;
+};
+
+struct CompactionOptions {
+  std::shared_ptr<CompactionStrategy> strategy;
+  // Automatic compaction starts once a segment is sealed and either limit is
+  // exceeded. A limit of 0 disables that trigger.
+  size_t max_segment_count = 0;
+  double max_space_amplification = 0.0;
+  // Automatic compaction advances a little on every write, copying only as
+  // many bytes as this budget has accumulated, so no single write waits for
+  // a whole compaction. 0 lets each step run to completion.
+  size_t bytes_per_second = 0;
+};
+
 class SimpleDbMultiSegments {
 public:
   SimpleDbMultiSegments(const std::string &dbname = "database",
-                        size_t segment_bytes_threshold = 1024 * 1024);
+                        size_t segment_bytes_threshold = 1024 * 1024,
+                        const CompactionOptions &compaction_options = {},
+                        const SegmentFileOptions &segment_file_options = {});
   void set(const std::string &key, const nlohmann::json &json_dict);
   nlohmann::json get(const std::string &key);
+  void remove(const std::string &key);
+  void flush();
+  ~SimpleDbMultiSegments();
   void compact(size_t new_segment_bytes_threshold = 0);
+  bool maybe_compact();
+  void finish_compaction();
+  bool is_compacting() const { return compaction_job != nullptr; }
+  std::vector<SegmentStats> get_segment_stats() const;
+  double get_space_amplification() const;
+  void create_index(const std::string &path);
+  std::vector<std::string> find(const std::string &path,
+                                const nlohmann::json &value) const;
 
   const std::vector<std::shared_ptr<Index>> &get_indexes() const {
     return indexes;
   }
+  const std::unordered_map<std::string, std::shared_ptr<SecondaryIndex>> &
+  get_secondary_indexes() const {
+    return secondary_indexes;
+  }
 
 private:
   std::string dbname;
   std::vector<std::shared_ptr<Index>> indexes;
+  std::unordered_map<std::string, std::shared_ptr<SecondaryIndex>>
+      secondary_indexes;
   bool indexes_loaded;
   size_t segment_bytes_threshold;
+  CompactionOptions compaction_options;
+  RateLimiter rate_limiter;
+  SegmentFileOptions segment_file_options;
+  std::unique_ptr<SegmentWriter> writer;
+  int64_t last_segment_timestamp;
+
+  // Records still to be copied by a compaction, and the segments it has
+  // written so far. They only replace the inputs once every record is copied.
+  struct CompactionJob {
+    std::vector<std::shared_ptr<Index>> inputs;
+    std::vector<std::pair<std::shared_ptr<Index>, std::string>> records;
+    size_t next_record = 0;
+    size_t segment_bytes_threshold;
+    bool rebuild_secondary_indexes;
+    std::unordered_map<std::string, std::shared_ptr<SecondaryIndex>>
+        secondary_indexes;
+    std::vector<std::shared_ptr<Index>> outputs;
+    std::unique_ptr<SegmentWriter> writer;
+    std::shared_ptr<Index> source;
+    std::ifstream input;
+  };
+  std::unique_ptr<CompactionJob> compaction_job;
 
   void check_db_directory();
   void load_index(Index &index);
   void load_indexes();
+  void write_manifest() const;
+  void append(const std::string &key, const std::string &line);
+  std::unique_ptr<SegmentWriter> open_writer(const Index &index,
+                                             size_t bytes_threshold) const;
+  void read_unflushed(const Index &index, size_t offset,
+                      std::string &line) const;
+  bool pick_compaction(std::vector<size_t> &positions,
+                       size_t &new_segment_bytes_threshold) const;
+  void start_compaction(const std::vector<size_t> &positions,
+                        size_t new_segment_bytes_threshold);
+  void step_compaction(bool blocking);
+  void copy_record(const std::shared_ptr<Index> &source,
+                   const std::string &key);
+  void complete_compaction();
+  void abandon_compaction();
+  std::string new_segment_name();
   int64_t get_epoch_time_in_microseconds() const;
 };
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <gtest/gtest.h>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -180,6 +181,593 @@ TEST_F(SimpleDbMultiSegmentsTest, CompactWithNewBytesThreshold) {
   EXPECT_EQ(values_before_compact, values_after_compact);
 }
 
+TEST_F(SimpleDbMultiSegmentsTest, CompactRemovesObsoleteSegments) {
+  db->set("greeting", {{"halo", "dunia"}});
+  std::vector<std::string> old_segments;
+  for (const auto &index : db->get_indexes()) {
+    old_segments.push_back(index->get_segment_name());
+  }
+
+  db->compact();
+
+  for (const auto &segment : old_segments) {
+    EXPECT_FALSE(fs::exists(segment));
+  }
+  SimpleDbMultiSegments db2(dbname);
+  EXPECT_EQ(db2.get_indexes().size(), db->get_indexes().size());
+  EXPECT_EQ(db2.get("greeting"), nlohmann::json({{"halo", "dunia"}}));
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, CompactFailsOnShortRead) {
+  db->set("greeting", {{"halo", "dunia"}});
+  db->create_index("/halo");
+  std::string segment = db->get_indexes()[1]->get_segment_name();
+  fs::resize_file(segment, 10);
+
+  EXPECT_THROW(db->compact(), std::runtime_error);
+  EXPECT_TRUE(fs::exists(segment));
+  EXPECT_EQ(db->get_indexes().size(), 3);
+  EXPECT_EQ(db->get("greeting"), nlohmann::json({{"halo", "dunia"}}));
+  EXPECT_EQ(db->find("/halo", "dunia"),
+            std::vector<std::string>({"greeting"}));
+
+  size_t segment_files = 0;
+  for (const auto &entry : fs::directory_iterator(dbname)) {
+    segment_files += entry.path().filename().string().find("segment_") == 0;
+  }
+  EXPECT_EQ(segment_files, 3);
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, LoadWithoutManifest) {
+  db->set("greeting", {{"halo", "dunia"}});
+  fs::remove(dbname + "/.simple_db_multi_segments_manifest");
+
+  SimpleDbMultiSegments db2(dbname);
+  EXPECT_EQ(db2.get_indexes().size(), 3);
+  EXPECT_EQ(db2.get("greeting"), nlohmann::json({{"halo", "dunia"}}));
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, SegmentStats) {
+  db->set("greeting", {{"halo", "dunia"}});
+
+  auto stats = db->get_segment_stats();
+  ASSERT_EQ(stats.size(), 3);
+  EXPECT_EQ(stats[0].dead_bytes(),
+            std::string("greeting,{\"hello\":\"world\"}\n").size());
+  EXPECT_EQ(stats[1].dead_bytes(), 0);
+  EXPECT_EQ(stats[2].dead_bytes(), 0);
+  EXPECT_GT(db->get_space_amplification(), 1.0);
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, CompactSelectedSegments) {
+  db->set("greeting", {{"halo", "dunia"}});
+  db->set("micu", {{"species", "cat"}, {"color", "white"}});
+  std::string untouched = db->get_indexes()[1]->get_segment_name();
+
+  DeadBytesRatioCompactionStrategy strategy(0.5);
+  auto stats = db->get_segment_stats();
+  stats.pop_back();
+  EXPECT_EQ(strategy.pick_segments(stats), std::vector<size_t>({0}));
+
+  CompactionOptions options;
+  options.strategy = std::make_shared<DeadBytesRatioCompactionStrategy>(0.5);
+  options.max_segment_count = 2;
+  SimpleDbMultiSegments db2(dbname, 50, options);
+  EXPECT_TRUE(db2.maybe_compact());
+  EXPECT_EQ(db2.get_indexes().size(), 2);
+  EXPECT_EQ(db2.get_indexes()[0]->get_segment_name(), untouched);
+  EXPECT_EQ(db2.get("greeting"), nlohmann::json({{"halo", "dunia"}}));
+  EXPECT_EQ(db2.get("micu"),
+            nlohmann::json({{"species", "cat"}, {"color", "white"}}));
+  EXPECT_EQ(db2.get("menu"), db->get("menu"));
+
+  SimpleDbMultiSegments reopened(dbname);
+  ASSERT_EQ(reopened.get_indexes().size(), db2.get_indexes().size());
+  for (size_t i = 0; i < db2.get_indexes().size(); ++i) {
+    EXPECT_EQ(reopened.get_indexes()[i]->get_segment_name(),
+              db2.get_indexes()[i]->get_segment_name());
+  }
+}
+
+TEST(CompactionStrategyTest, ReopenAfterAutomaticCompaction) {
+  std::string dbname = "testdb_reopen";
+  remove_directory(dbname);
+  {
+    CompactionOptions options;
+    options.strategy = std::make_shared<DeadBytesRatioCompactionStrategy>(0.1);
+    options.max_segment_count = 1;
+    SimpleDbMultiSegments db(dbname, 30, options);
+    db.set("a", {{"v", 1}});
+    db.set("a", {{"v", 2}});
+    for (const auto &key : {"x", "b", "c", "d"}) {
+      db.set(key, {{"v", 0}});
+    }
+    std::string first_segment = db.get_indexes()[0]->get_segment_name();
+    db.set("e", {{"v", 0}});
+    ASSERT_FALSE(fs::exists(first_segment));
+    db.set("a", {{"v", 3}});
+    EXPECT_EQ(db.get("a"), nlohmann::json({{"v", 3}}));
+  }
+
+  SimpleDbMultiSegments db(dbname, 30);
+  EXPECT_EQ(db.get("a"), nlohmann::json({{"v", 3}}));
+  for (const auto &key : {"x", "b", "c", "d", "e"}) {
+    EXPECT_EQ(db.get(key), nlohmann::json({{"v", 0}}));
+  }
+  remove_directory(dbname);
+}
+
+TEST(CompactionStrategyTest, SizeTieredAutomaticCompaction) {
+  std::string dbname = "testdb_tiered";
+  remove_directory(dbname);
+  {
+    CompactionOptions options;
+    options.strategy = std::make_shared<SizeTieredCompactionStrategy>(4);
+    options.max_segment_count = 8;
+    SimpleDbMultiSegments db(dbname, 100, options);
+    for (int i = 0; i < 2000; ++i) {
+      db.set("key" + std::to_string(i), {{"v", i}});
+    }
+
+    // Without tiering this would be about 250 segments of 100 bytes.
+    EXPECT_LE(db.get_indexes().size(), 16);
+    size_t largest = 0;
+    for (const auto &index : db.get_indexes()) {
+      largest = std::max(largest, index->get_cursor());
+    }
+    EXPECT_GE(largest, 64 * 100);
+    for (int i = 0; i < 2000; i += 97) {
+      EXPECT_EQ(db.get("key" + std::to_string(i)), nlohmann::json({{"v", i}}));
+    }
+  }
+  remove_directory(dbname);
+}
+
+TEST(CompactionStrategyTest, RateLimitedCompactionKeepsWritesFast) {
+  std::string dbname = "testdb_latency";
+  remove_directory(dbname);
+  std::string text(40, 'x');
+  {
+    CompactionOptions options;
+    options.strategy = std::make_shared<SizeTieredCompactionStrategy>(4);
+    options.max_segment_count = 4;
+    options.bytes_per_second = 50000;
+    SimpleDbMultiSegments db(dbname, 1000, options);
+
+    // Merging the larger tiers copies well over a second's worth of the
+    // budget, which no single set() may wait for.
+    auto slowest = std::chrono::steady_clock::duration::zero();
+    size_t rolls = 0;
+    bool compacting = false;
+    for (int i = 0; i < 3000; ++i) {
+      size_t segments = db.get_indexes().size();
+      auto start = std::chrono::steady_clock::now();
+      db.set("key" + std::to_string(i), {{"v", i}, {"text", text}});
+      slowest = std::max(slowest, std::chrono::steady_clock::now() - start);
+      rolls += db.get_indexes().size() > segments;
+      compacting = compacting || db.is_compacting();
+    }
+    EXPECT_LT(slowest, std::chrono::milliseconds(50));
+    EXPECT_TRUE(compacting);
+    EXPECT_LT(db.get_indexes().size(), rolls);
+    for (int i = 0; i < 3000; i += 71) {
+      EXPECT_EQ(db.get("key" + std::to_string(i)),
+                nlohmann::json({{"v", i}, {"text", text}}));
+    }
+  }
+
+  // A compaction still running at close is dropped without losing data.
+  SimpleDbMultiSegments db(dbname, 1000);
+  for (int i = 0; i < 3000; i += 71) {
+    EXPECT_EQ(db.get("key" + std::to_string(i)),
+              nlohmann::json({{"v", i}, {"text", text}}));
+  }
+  remove_directory(dbname);
+}
+
+TEST(CompactionStrategyTest, ActiveSegmentFillsBeforeRolling) {
+  std::string dbname = "testdb_cyclic";
+  remove_directory(dbname);
+  {
+    CompactionOptions options;
+    options.strategy = std::make_shared<DeadBytesRatioCompactionStrategy>(0.3);
+    options.max_space_amplification = 1.2;
+    SimpleDbMultiSegments db(dbname, 100, options);
+    for (int i = 0; i < 500; ++i) {
+      std::string active = db.get_indexes().empty()
+                               ? ""
+                               : db.get_indexes().back()->get_segment_name();
+      std::string key = "key" + std::to_string(i % 40);
+      db.set(key, {{"v", i}});
+
+      // Writes always land at the end of the newest segment, and a segment
+      // append() stops writing to is either full or compacted away.
+      const auto &last = *db.get_indexes().back();
+      ASSERT_TRUE(last.get_idx_map().count(key));
+      auto [offset, length] = last.get_idx_map().at(key);
+      EXPECT_EQ(offset + length, last.get_cursor());
+      for (const auto &index : db.get_indexes()) {
+        if (index->get_segment_name() == active &&
+            index != db.get_indexes().back()) {
+          EXPECT_GE(index->get_cursor(), 100);
+        }
+      }
+    }
+    for (int i = 460; i < 500; ++i) {
+      EXPECT_EQ(db.get("key" + std::to_string(i % 40)),
+                nlohmann::json({{"v", i}}));
+    }
+
+    // Merged segments sit among older ones; the manifest keeps that order.
+    SimpleDbMultiSegments reopened(dbname, 100);
+    ASSERT_EQ(reopened.get_indexes().size(), db.get_indexes().size());
+    for (size_t i = 0; i < db.get_indexes().size(); ++i) {
+      EXPECT_EQ(reopened.get_indexes()[i]->get_segment_name(),
+                db.get_indexes()[i]->get_segment_name());
+    }
+    for (int i = 460; i < 500; ++i) {
+      EXPECT_EQ(reopened.get("key" + std::to_string(i % 40)),
+                nlohmann::json({{"v", i}}));
+    }
+  }
+  remove_directory(dbname);
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, SecondaryIndex) {
+  EXPECT_THROW(db->find("/species", "cat"), NoSuchIndexError);
+
+  db->create_index("/species");
+  EXPECT_EQ(db->find("/species", "cat"), std::vector<std::string>({"micu"}));
+  EXPECT_TRUE(db->find("/species", "dog").empty());
+
+  db->set("belang", {{"species", "cat"}, {"color", "orange"}});
+  db->set("micu", {{"species", "dog"}});
+  EXPECT_EQ(db->find("/species", "cat"), std::vector<std::string>({"belang"}));
+  EXPECT_EQ(db->find("/species", "dog"), std::vector<std::string>({"micu"}));
+
+  db->compact();
+  EXPECT_EQ(db->find("/species", "cat"), std::vector<std::string>({"belang"}));
+  EXPECT_EQ(db->find("/species", "dog"), std::vector<std::string>({"micu"}));
+
+  SimpleDbMultiSegments db2(dbname);
+  db2.create_index("/lunch");
+  EXPECT_EQ(db2.find("/lunch", "nasi rendang"),
+            std::vector<std::string>({"menu"}));
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, SecondaryIndexMatchesNumbersByValue) {
+  db->set("apple", {{"price", 199}, {"size", {1, 2.0}}});
+  db->set("pear", {{"price", 199.0}, {"size", {1.0, 2}}});
+  db->set("plum", {{"price", 199.5}, {"size", 0.0}});
+  db->set("fig", {{"price", -1}, {"size", -0.0}});
+  db->create_index("/price");
+  db->create_index("/size");
+
+  std::vector<std::string> expected({"apple", "pear"});
+  EXPECT_EQ(db->find("/price", 199), expected);
+  EXPECT_EQ(db->find("/price", 199.0), expected);
+  EXPECT_EQ(db->find("/price", 199u), expected);
+  EXPECT_EQ(db->find("/price", 199.5), std::vector<std::string>({"plum"}));
+  EXPECT_EQ(db->find("/price", -1.0), std::vector<std::string>({"fig"}));
+  EXPECT_EQ(db->find("/size", {1, 2}), expected);
+  EXPECT_EQ(db->find("/size", 0), std::vector<std::string>({"fig", "plum"}));
+  EXPECT_TRUE(db->find("/price", "199").empty());
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, Remove) {
+  db->create_index("/species");
+  db->remove("micu");
+  EXPECT_EQ(db->get("micu"), nullptr);
+  EXPECT_TRUE(db->find("/species", "cat").empty());
+
+  size_t cursor = db->get_indexes().back()->get_cursor();
+  db->remove("micu");
+  db->remove("invalid key");
+  EXPECT_EQ(db->get_indexes().back()->get_cursor(), cursor);
+
+  SimpleDbMultiSegments db2(dbname);
+  EXPECT_EQ(db2.get("micu"), nullptr);
+  EXPECT_EQ(db2.get("greeting"), nlohmann::json({{"hello", "world"}}));
+
+  db->set("micu", {{"species", "cat"}});
+  EXPECT_EQ(db->get("micu"), nlohmann::json({{"species", "cat"}}));
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, CompactDropsTombstones) {
+  db->remove("micu");
+  db->compact();
+
+  EXPECT_EQ(db->get("micu"), nullptr);
+  for (const auto &index : db->get_indexes()) {
+    EXPECT_TRUE(index->get_idx_map().find("micu") ==
+                index->get_idx_map().end());
+  }
+  EXPECT_EQ(db->get("menu"), nlohmann::json({{"breakfast", "bubur ayam"},
+                                             {"lunch", "nasi rendang"},
+                                             {"dinner", "nasi goreng"}}));
+}
+
+// Always picks the same segments, to compact a chosen subset.
+class FixedCompactionStrategy : public CompactionStrategy {
+public:
+  FixedCompactionStrategy(std::vector<size_t> positions)
+      : positions(std::move(positions)) {}
+  std::vector<size_t>
+  pick_segments(const std::vector<SegmentStats> &) const override {
+    return positions;
+  }
+
+private:
+  std::vector<size_t> positions;
+};
+
+TEST_F(SimpleDbMultiSegmentsTest, CompactKeepsTombstoneOfSurvivingSegment) {
+  db->remove("micu");
+  nlohmann::json padding = {{"text", "enough bytes to seal the third segment"}};
+  db->set("padding", padding);
+  db->set("greeting", {{"halo", "dunia"}});
+  ASSERT_EQ(db->get_indexes().size(), 4);
+  ASSERT_TRUE(db->get_indexes()[2]->is_tombstone("micu"));
+
+  CompactionOptions options;
+  options.strategy =
+      std::make_shared<FixedCompactionStrategy>(std::vector<size_t>({2}));
+  options.max_segment_count = 1;
+  SimpleDbMultiSegments db2(dbname, 50, options);
+  EXPECT_TRUE(db2.maybe_compact());
+  EXPECT_EQ(db2.get("micu"), nullptr);
+  size_t tombstones = 0;
+  for (const auto &index : db2.get_indexes()) {
+    tombstones += index->is_tombstone("micu");
+  }
+  EXPECT_EQ(tombstones, 1);
+
+  // Once the first segment is merged as well, nothing is left to shadow.
+  SimpleDbMultiSegments reopened(dbname);
+  std::vector<size_t> positions = {0};
+  for (size_t i = 0; i < reopened.get_indexes().size(); ++i) {
+    if (reopened.get_indexes()[i]->is_tombstone("micu")) {
+      positions.push_back(i);
+    }
+  }
+  options.strategy = std::make_shared<FixedCompactionStrategy>(positions);
+  SimpleDbMultiSegments db3(dbname, 50, options);
+  EXPECT_EQ(db3.get("micu"), nullptr);
+  EXPECT_TRUE(db3.maybe_compact());
+  EXPECT_EQ(db3.get("micu"), nullptr);
+  for (const auto &index : db3.get_indexes()) {
+    EXPECT_TRUE(index->get_idx_map().find("micu") ==
+                index->get_idx_map().end());
+  }
+  EXPECT_EQ(db3.get("greeting"), nlohmann::json({{"halo", "dunia"}}));
+  EXPECT_EQ(db3.get("padding"), padding);
+}
+
+class SegmentFileTest : public ::testing::Test {
+protected:
+  std::string dbname = "testdb_direct";
+  SegmentFileOptions options;
+  bool preallocated;
+
+  // O_DIRECT and fallocate depend on the file system, so probe them before
+  // testing the paths that need them.
+  void SetUp() override {
+    remove_directory(dbname);
+    options.preallocate = true;
+    options.direct_io = true;
+    std::string probe = dbname + "_probe";
+    {
+      SegmentWriter writer(probe, 0, options, 10000);
+      preallocated = writer.is_preallocated();
+      if (!writer.is_direct()) {
+        fs::remove(probe);
+        GTEST_SKIP() << "O_DIRECT is not supported here";
+      }
+    }
+    fs::remove(probe);
+  }
+
+  void TearDown() override { remove_directory(dbname); }
+};
+
+TEST_F(SegmentFileTest, SegmentWriter) {
+  std::string segment = dbname + "_segment";
+  std::string expected;
+  {
+    SegmentWriter writer(segment, 0, options, 10000);
+    ASSERT_TRUE(writer.is_direct());
+    for (int i = 0; i < 300; ++i) {
+      std::string record = "key" + std::to_string(i) + ",{\"value\":1}\n";
+      size_t offset = expected.size();
+      expected += record;
+      writer.write(record);
+
+      std::string tail(record.size(), '\0');
+      std::ifstream file(segment);
+      file.seekg(offset);
+      file.read(&tail[0], record.size());
+      writer.read_unflushed(offset, tail);
+      EXPECT_EQ(tail, record);
+    }
+    if (preallocated) {
+      EXPECT_GE(fs::file_size(segment), 10000);
+    } else {
+      // Only whole blocks have been written so far.
+      EXPECT_LT(fs::file_size(segment), expected.size());
+    }
+    writer.seal();
+  }
+  EXPECT_EQ(fs::file_size(segment), expected.size());
+
+  // Reopening in the middle of a block keeps the bytes already there.
+  {
+    SegmentWriter writer(segment, expected.size(), options, 10000);
+    writer.write("last,{}\n");
+    expected += "last,{}\n";
+  }
+  std::ifstream file(segment);
+  EXPECT_EQ(std::string(std::istreambuf_iterator<char>(file), {}), expected);
+  fs::remove(segment);
+}
+
+TEST_F(SegmentFileTest, PreallocatedDirectIo) {
+  std::string expected;
+  {
+    SimpleDbMultiSegments db(dbname, 10000, {}, options);
+    for (int i = 0; i < 200; ++i) {
+      nlohmann::json value = {{"value", i}, {"text", std::string(i % 50, 'x')}};
+      db.set("key" + std::to_string(i % 150), value);
+      expected += "key" + std::to_string(i % 150) + "," + value.dump() + "\n";
+    }
+    ASSERT_EQ(db.get_indexes().size(), 2);
+    if (preallocated) {
+      EXPECT_GE(fs::file_size(db.get_indexes()[1]->get_segment_name()), 10000);
+    }
+    EXPECT_EQ(db.get("key10"),
+              nlohmann::json({{"value", 160}, {"text", std::string(10, 'x')}}));
+    EXPECT_EQ(db.get("key49"),
+              nlohmann::json({{"value", 199}, {"text", std::string(49, 'x')}}));
+
+    db.create_index("/value");
+    EXPECT_EQ(db.find("/value", 199), std::vector<std::string>({"key49"}));
+  }
+
+  SimpleDbMultiSegments db(dbname, 10000, {}, options);
+  std::string actual;
+  for (const auto &index : db.get_indexes()) {
+    EXPECT_EQ(fs::file_size(index->get_segment_name()), index->get_cursor());
+    std::ifstream file(index->get_segment_name());
+    actual += std::string(std::istreambuf_iterator<char>(file), {});
+  }
+  EXPECT_EQ(actual, expected);
+
+  db.set("key0", {{"value", "new"}});
+  db.compact();
+  EXPECT_EQ(db.get("key0"), nlohmann::json({{"value", "new"}}));
+  EXPECT_EQ(db.get("key149"), nlohmann::json({{"value", 149},
+                                              {"text", std::string(49, 'x')}}));
+  for (const auto &index : db.get_indexes()) {
+    EXPECT_EQ(fs::file_size(index->get_segment_name()), index->get_cursor());
+  }
+}
+
+TEST_F(SegmentFileTest, SegmentWriterShortRead) {
+  fs::create_directory(dbname);
+  std::string segment = dbname + "/segment.db";
+  std::ofstream(segment) << "a,1\n";
+  auto open_fds = [] {
+    return std::distance(fs::directory_iterator("/proc/self/fd"),
+                         fs::directory_iterator());
+  };
+  auto fds = open_fds();
+  EXPECT_THROW(SegmentWriter(segment, 10, options, 0), std::runtime_error);
+  EXPECT_EQ(open_fds(), fds);
+  EXPECT_EQ(fs::file_size(segment), 4u);
+}
+
+TEST_F(SegmentFileTest, FlushPublishesBufferedWrites) {
+  SimpleDbMultiSegments db(dbname, 10000, {}, options);
+  db.set("a", {{"v", 1}});
+  db.set("b", {{"v", 2}});
+  {
+    SimpleDbMultiSegments other(dbname);
+    EXPECT_EQ(other.get("a"), nullptr);
+  }
+
+  db.flush();
+  SimpleDbMultiSegments other(dbname);
+  EXPECT_EQ(other.get("a"), nlohmann::json({{"v", 1}}));
+  EXPECT_EQ(other.get("b"), nlohmann::json({{"v", 2}}));
+
+  // Writing after a flush completes the same block rather than skipping it.
+  db.set("c", {{"v", 3}});
+  db.flush();
+  SimpleDbMultiSegments reopened(dbname);
+  EXPECT_EQ(reopened.get("b"), nlohmann::json({{"v", 2}}));
+  EXPECT_EQ(reopened.get("c"), nlohmann::json({{"v", 3}}));
+  EXPECT_EQ(reopened.get_indexes().back()->get_cursor(),
+            db.get_indexes().back()->get_cursor());
+}
+
+TEST_F(SimpleDbMultiSegmentsTest, UnsealedSegmentPadding) {
+  std::string segment = db->get_indexes()[1]->get_segment_name();
+  size_t cursor = db->get_indexes()[1]->get_cursor();
+  std::ofstream(segment, std::ios::app) << std::string(100, '\0');
+
+  SimpleDbMultiSegments db2(dbname);
+  EXPECT_EQ(db2.get_indexes()[1]->get_cursor(), cursor);
+  db2.set("rendang", {{"origin", "padang"}});
+  EXPECT_EQ(db2.get("rendang"), nlohmann::json({{"origin", "padang"}}));
+  EXPECT_EQ(db2.get("menu"), db->get("menu"));
+}
+
+TEST(CompactionStrategyTest, SizeTieredPicksSimilarSizes) {
+  SizeTieredCompactionStrategy strategy(3);
+  std::vector<SegmentStats> segments = {
+      {0, 1000, 1000}, {1, 100, 100}, {2, 110, 110},
+      {3, 1050, 1050}, {4, 90, 90},   {5, 5000, 5000}};
+  EXPECT_EQ(strategy.pick_segments(segments), std::vector<size_t>({1, 2, 4}));
+
+  segments.erase(segments.begin() + 4);
+  EXPECT_TRUE(strategy.pick_segments(segments).empty());
+}
+
+TEST(CompactionStrategyTest, DeadBytesRatioPicksMostGarbage) {
+  DeadBytesRatioCompactionStrategy strategy(0.3, 2);
+  std::vector<SegmentStats> segments = {
+      {0, 100, 60}, {1, 100, 10}, {2, 100, 90}, {3, 100, 40}};
+  EXPECT_EQ(strategy.pick_segments(segments), std::vector<size_t>({1, 3}));
+}
+
+TEST(CompactionStrategyTest, AutomaticCompaction) {
+  std::string dbname = "testdb_auto";
+  remove_directory(dbname);
+  {
+    CompactionOptions options;
+    options.strategy = std::make_shared<DeadBytesRatioCompactionStrategy>();
+    options.max_space_amplification = 2.0;
+    SimpleDbMultiSegments db(dbname, 50, options);
+    for (int i = 0; i < 100; ++i) {
+      db.set("counter", {{"value", i}});
+      db.set("micu", {{"species", "cat"}});
+    }
+    EXPECT_LE(db.get_indexes().size(), 4);
+    EXPECT_EQ(db.get("counter"), nlohmann::json({{"value", 99}}));
+    EXPECT_EQ(db.get("micu"), nlohmann::json({{"species", "cat"}}));
+  }
+  remove_directory(dbname);
+}
+
+TEST(RateLimiterTest, Throttles) {
+  RateLimiter unlimited;
+  auto start = std::chrono::steady_clock::now();
+  unlimited.acquire(1000000);
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(50));
+
+  RateLimiter limiter(10000, 1000);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 4; ++i) {
+    limiter.acquire(1000);
+  }
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(250));
+}
+
+TEST(RateLimiterTest, TryAcquireNeverWaits) {
+  RateLimiter limiter(10000, 1000);
+  EXPECT_TRUE(limiter.try_acquire(800));
+  EXPECT_FALSE(limiter.try_acquire(800));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(limiter.try_acquire(800));
+
+  // Larger than the bucket: granted only once the bucket is full.
+  EXPECT_FALSE(limiter.try_acquire(5000));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(limiter.try_acquire(5000));
+  EXPECT_FALSE(limiter.try_acquire(1));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();